@@ -27,13 +27,23 @@
 #include <linux/version.h>
 #include <linux/mm.h>
 #include <linux/time.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,7,0)
+#include <linux/io_uring/cmd.h>
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5,19,0)
+#include <linux/io_uring.h>
+#endif
 #if LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,37)
 #include <linux/smp_lock.h>
 #endif
 #include <asm/atomic.h>
-#include <asm/uaccess.h>
+#include <linux/uaccess.h>
 #include <asm/io.h>
 #include "symmbc7x.h"
+#include "symmbc7x_ext.h"
 
 
 //-------------------------------------------------------------------------
@@ -43,6 +53,48 @@
 #define DRIVER_NAME "symmbc7x"
 #define DEV_NAME    "bc750"
 
+//-------------------------------------------------------------------------
+// Kernel API compatibility
+//-------------------------------------------------------------------------
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,0,0)
+    #define symmbc_access_ok(type, addr, size) access_ok(addr, size)
+#else
+    #define symmbc_access_ok(type, addr, size) access_ok(type, addr, size)
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,3,0)
+    #define symmbc_vm_flags_set(vma, flags)   vm_flags_set(vma, flags)
+    #define symmbc_vm_flags_clear(vma, flags) vm_flags_clear(vma, flags)
+#else
+    #define symmbc_vm_flags_set(vma, flags)   ((vma)->vm_flags |= (flags))
+    #define symmbc_vm_flags_clear(vma, flags) ((vma)->vm_flags &= ~(flags))
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,4,0)
+    #define symmbc_class_create(name) class_create(name)
+#else
+    #define symmbc_class_create(name) class_create(THIS_MODULE, name)
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,14,0)
+    #define symmbc_store_release(p, v) smp_store_release(p, v)
+#else
+    #define symmbc_store_release(p, v) do { smp_mb(); ACCESS_ONCE(*(p)) = (v); } while (0)
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,19,0)
+    #define symmbc_write_once(x, v) WRITE_ONCE(x, v)
+#else
+    #define symmbc_write_once(x, v) (ACCESS_ONCE(x) = (v))
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,17,0)
+    #define symmbc_mono_to_real(t) ktime_mono_to_real(t)
+#else
+    // Offset read back to back, off by at most the gap between the reads
+    #define symmbc_mono_to_real(t) ktime_add(t, ktime_sub(ktime_get_real(), ktime_get()))
+#endif
+
 //-------------------------------------------------------------------------
 // Vendor id - Freescale (MPC8008), and device id
 //-------------------------------------------------------------------------
@@ -59,6 +111,14 @@
 //-------------------------------------------------------------------------
 #define SYMMBC_NUM_DEVS 8
 
+//-------------------------------------------------------------------------
+// Offset history defaults and limits
+//-------------------------------------------------------------------------
+#define SYMMBC_HIST_LEN     131072
+#define SYMMBC_HIST_MIN_LEN 64
+#define SYMMBC_HIST_MAX_LEN (1 << 22)
+#define SYMMBC_HIST_MAX_HZ  100000
+
 //-------------------------------------------------------------------------
 // Define the following in case pci.h does not
 //-------------------------------------------------------------------------
@@ -90,6 +150,28 @@
 #define FPGA_HOST_MAJOR_TIME_OFFSET 0x020
 #define FPGA_HOST_MINOR_TIME_OFFSET 0x024
 
+//-------------------------------------------------------------------------
+// Card time from the target FPGA. symmbc7x.h gives the BAR4 offsets of the
+// big-endian seconds and sub-second registers and the sub-second unit;
+// without them the features reading the card time are unavailable.
+//-------------------------------------------------------------------------
+#if defined(FPGA_CARD_MAJOR_TIME_OFFSET) && \
+    defined(FPGA_CARD_MINOR_TIME_OFFSET) && \
+    defined(FPGA_CARD_MINOR_TIME_UNIT_NS)
+    #define SYMMBC_CARD_TIME 1
+#else
+    #define SYMMBC_CARD_TIME 0
+#endif
+
+//-------------------------------------------------------------------------
+// io_uring passthrough (5.19+) is only built with make SYMMBC_URING=1
+// until it has been built against each io_uring API band
+//-------------------------------------------------------------------------
+#if defined(SYMMBC_URING_CMD) && LINUX_VERSION_CODE >= KERNEL_VERSION(5,19,0)
+    #define SYMMBC_URING 1
+#else
+    #define SYMMBC_URING 0
+#endif
 
 //-------------------------------------------------------------------------
 // Date type - per device structure
@@ -103,6 +185,14 @@ struct symmbc_dev {
     struct mutex    mtx;
     struct pci_dev *ppci_dev;
     struct cdev     cdev;
+
+    // Offset history ring, NULL unless symmbc_hist_hz is set
+    hist_ring      *hist;
+    u32             hist_mask;
+    u64             hist_head;
+    u64             hist_missed;
+    ktime_t         hist_period;
+    struct hrtimer  hist_timer;
 };
 
 
@@ -119,6 +209,16 @@ module_param(symmbc_ndevs, int, 0);
 MODULE_PARM_DESC(symmbc_ndevs,
         "Maximum number of bc7xxPCIe cards (default: 8)");
 
+static int symmbc_hist_hz = 0;
+module_param(symmbc_hist_hz, int, 0);
+MODULE_PARM_DESC(symmbc_hist_hz,
+        "Offset history sampling rate in Hz, 0 disables (default: 0)");
+
+static int symmbc_hist_len = SYMMBC_HIST_LEN;
+module_param(symmbc_hist_len, int, 0);
+MODULE_PARM_DESC(symmbc_hist_len,
+        "Offset history ring size in samples (default: 131072)");
+
 //-------------------------------------------------------------------------
 // Module information
 //-------------------------------------------------------------------------
@@ -144,6 +244,7 @@ static void symmbc_remove(struct pci_dev *pdev);
 static int symmbc_open(struct inode *inode, struct file *filp);
 static int symmbc_release(struct inode *inode, struct file *filp);
 static int symmbc_mmap(struct file *filp, struct vm_area_struct *vma);
+static int symmbc_card_time_reg(struct symmbc_dev *pbc_dev, resource_size_t *phys);
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,11)
 static long symmbc_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
@@ -151,6 +252,13 @@ static long symmbc_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned
 static int symmbc_ioctl(struct inode *inode, struct file *filp, unsigned int cmd, unsigned long arg);
 #endif
 static irqreturn_t symmbc_irq(int irq, void *dev_id);
+static void symmbc_hist_start(struct symmbc_dev *pbc_dev);
+static void symmbc_hist_stop(struct symmbc_dev *pbc_dev);
+static long symmbc_get_time_samples(struct symmbc_dev *pbc_dev, unsigned long arg);
+static long symmbc_get_time_mmap_config(struct symmbc_dev *pbc_dev, unsigned long arg);
+#if SYMMBC_URING
+static int symmbc_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags);
+#endif
 
 
 //-------------------------------------------------------------------------
@@ -176,6 +284,9 @@ static struct file_operations symmbc_fops = {
 #else
     .ioctl   = symmbc_ioctl,
 #endif
+#if SYMMBC_URING
+    .uring_cmd = symmbc_uring_cmd,
+#endif
 };
 
 // Sysfs class
@@ -196,7 +307,12 @@ static int symmbc_probe(struct pci_dev *pdev, const struct pci_device_id *ent)
     u64 l_u64Addr;
     struct device *psys_dev = NULL;
     dev_t dev_num;
-    struct timeval tv;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,17,0)
+    struct timespec64 ts;
+#else
+    struct timeval ts;
+#endif
+    u32 host_sec, host_usec;
     u8 *pFPGA;
 
     if (SYMMBC_VENDOR_ID != ent->vendor || SYMMBC_DEVICE_ID != ent->device) {
@@ -318,7 +434,7 @@ static int symmbc_probe(struct pci_dev *pdev, const struct pci_device_id *ent)
         rc = -ENOMEM;
         goto exit_release;
     }
-    pr_info(DEV_NAME " host DMA address: 0x%llx\n", pbc_dev->dma_base);
+    pr_info(DEV_NAME " host DMA address: 0x%llx\n", (u64)pbc_dev->dma_base);
 
     // BAR1 points to the MPC8308 IMMR
     pPCIeIMMR = (u8 *)pbc_dev->iomap_base[1];
@@ -361,17 +477,29 @@ static int symmbc_probe(struct pci_dev *pdev, const struct pci_device_id *ent)
     atomic_inc(&curr_minor);
 
     // Retrieve the host system time - we do this at the last
-    do_gettimeofday(&tv);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,17,0)
+    ktime_get_real_ts64(&ts);
+    host_sec  = (u32)ts.tv_sec;
+    host_usec = (u32)(ts.tv_nsec / NSEC_PER_USEC);
+#else
+    do_gettimeofday(&ts);
+    host_sec  = (u32)ts.tv_sec;
+    host_usec = (u32)ts.tv_usec;
+#endif
 
     // Write the host system time to the target FPGA memory
     pFPGA = (u8 *)pbc_dev->iomap_base[4];
 
-    *((u32 *)(pFPGA + FPGA_HOST_MAJOR_TIME_OFFSET)) = cpu_to_be32(tv.tv_sec);
-    *((u32 *)(pFPGA + FPGA_HOST_MINOR_TIME_OFFSET)) = cpu_to_be32(tv.tv_usec);
+    *((u32 *)(pFPGA + FPGA_HOST_MAJOR_TIME_OFFSET)) = cpu_to_be32(host_sec);
+    *((u32 *)(pFPGA + FPGA_HOST_MINOR_TIME_OFFSET)) = cpu_to_be32(host_usec);
 
     // Set the host ready bit
     *((u16 *)(pFPGA + FPGA_HOST_READY_OFFSET)) = cpu_to_be16(1);
 
+    // Start the offset history recorder if requested
+    if (symmbc_hist_hz > 0)
+        symmbc_hist_start(pbc_dev);
+
     pr_info("bcpci%d: created.\n", pbc_dev->dev_minor);
     return 0;
 
@@ -403,6 +531,7 @@ void symmbc_remove(struct pci_dev *pdev)
     int i;
     struct symmbc_dev *pbc_dev = pci_get_drvdata(pdev);
 
+    symmbc_hist_stop(pbc_dev);
     mutex_destroy(&pbc_dev->mtx);
     dma_free_coherent(&pbc_dev->ppci_dev->dev, DMA_BUFFER_SIZE,
         pbc_dev->mem_base, pbc_dev->dma_base);
@@ -467,14 +596,26 @@ long symmbc_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned long ar
     u64  l_u64Addr;
 
     if (SYMMBC_IOC_MAGIC != _IOC_TYPE(cmd)) return -ENOTTY;
-    if (_IOC_NR(cmd) > SYMMBC_IOC_MAX) return -ENOTTY;
+    if (_IOC_NR(cmd) > SYMMBC_IOC_MAX &&
+        (_IOC_NR(cmd) < SYMMBC_IOC_EXT_BASE || _IOC_NR(cmd) > SYMMBC_IOC_EXT_MAX))
+        return -ENOTTY;
 
     if (_IOC_DIR(cmd) & _IOC_READ)
-        rc = !access_ok(VERIFY_WRITE, (void __user *)arg, _IOC_SIZE(cmd));
+        rc = !symmbc_access_ok(VERIFY_WRITE, (void __user *)arg, _IOC_SIZE(cmd));
     else if (_IOC_DIR(cmd) & _IOC_WRITE)
-        rc =  !access_ok(VERIFY_READ, (void __user *)arg, _IOC_SIZE(cmd));
+        rc =  !symmbc_access_ok(VERIFY_READ, (void __user *)arg, _IOC_SIZE(cmd));
     if (rc) return -EFAULT;
 
+    // Commands that do not touch the card configuration run unlocked
+    switch(cmd) {
+
+        case SYMMBC_IOC_GET_TIME_SAMPLES:
+            return symmbc_get_time_samples(pdev, arg);
+
+        case SYMMBC_IOC_GET_TIME_MMAP_CONFIG:
+            return symmbc_get_time_mmap_config(pdev, arg);
+    }
+
 #if LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,37)
     lock_kernel();
 #else
@@ -510,6 +651,16 @@ long symmbc_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned long ar
             break;
 
         case SYMMBC_IOC_SET_DMA_BUS_ADDR:
+            // Read-only opens may not reprogram the card
+            if (!(filp->f_mode & FMODE_WRITE)) {
+#if LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,37)
+                unlock_kernel();
+#else
+                mutex_unlock(&pdev->mtx);
+#endif
+                return -EPERM;
+            }
+
             // Set the Norfolk card's PCI Express Outbound Window Registers to 
             // address the Host Local DMA memory. This is for target initiated writes.
 
@@ -594,6 +745,10 @@ int symmbc_ioctl(struct inode *inode, struct file *filp, unsigned int cmd, unsig
             break;
 
         case SYMMBC_IOC_SET_DMA_BUS_ADDR:
+            // Read-only opens may not reprogram the card
+            if (!(filp->f_mode & FMODE_WRITE))
+                return -EPERM;
+
             // Set the Norfolk card's PCI Express Outbound Window Registers to 
             // address the Host Local DMA memory. This is for target initiated writes.
 
@@ -636,11 +791,52 @@ int symmbc_mmap(struct file *filp, struct vm_area_struct *vma)
 
     if (vma->vm_pgoff < PCI_STD_RESOURCES ||
         (vma->vm_pgoff > PCI_STD_RESOURCE_END &&
-         DMA_MMAP_PGOFF != vma->vm_pgoff)) {
+         DMA_MMAP_PGOFF != vma->vm_pgoff &&
+         HIST_MMAP_PGOFF != vma->vm_pgoff &&
+         TIME_MMAP_PGOFF != vma->vm_pgoff)) {
         pr_err("<-- %s: invalid input (pgoff=%lu).\n", __func__, vma->vm_pgoff);
         return -EFAULT;
     }
-    if (DMA_MMAP_PGOFF == vma->vm_pgoff) {
+    // The BARs hold control registers, read-only opens do not get them
+    if (vma->vm_pgoff <= PCI_STD_RESOURCE_END && !(filp->f_mode & FMODE_WRITE)) {
+        pr_err("<-- %s: BAR %lu needs a writable open.\n", __func__, vma->vm_pgoff);
+        return -EPERM;
+    }
+    if (TIME_MMAP_PGOFF == vma->vm_pgoff) {
+        if (symmbc_card_time_reg(pdev, &start)) {
+            pr_err("<-- %s: card time registers are not available.\n", __func__);
+            return -ENODEV;
+        }
+        if (vma->vm_end - vma->vm_start != PAGE_SIZE || (vma->vm_flags & VM_WRITE)) {
+            pr_err("<-- %s: time registers map one page read-only.\n", __func__);
+            return -EINVAL;
+        }
+        symmbc_vm_flags_clear(vma, VM_MAYWRITE);
+        symmbc_vm_flags_set(vma, VM_IO | VM_DONTEXPAND);
+        vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+        if (remap_pfn_range(vma, vma->vm_start,
+                ((unsigned long)start) >> PAGE_SHIFT,
+                PAGE_SIZE, vma->vm_page_prot)) {
+            pr_err("<-- %s: remap_pfn_range(TIME) failed.\n", __func__);
+            return -EAGAIN;
+        }
+    }
+    else if (HIST_MMAP_PGOFF == vma->vm_pgoff) {
+        if (!pdev->hist) {
+            pr_err("<-- %s: offset history is not enabled.\n", __func__);
+            return -ENODEV;
+        }
+        if (vma->vm_flags & VM_WRITE) {
+            pr_err("<-- %s: offset history maps read-only.\n", __func__);
+            return -EINVAL;
+        }
+        symmbc_vm_flags_clear(vma, VM_MAYWRITE);
+        if (remap_vmalloc_range(vma, pdev->hist, 0)) {
+            pr_err("<-- %s: remap_vmalloc_range(HIST) failed.\n", __func__);
+            return -EINVAL;
+        }
+    }
+    else if (DMA_MMAP_PGOFF == vma->vm_pgoff) {
         if (remap_pfn_range(vma, vma->vm_start,
                 virt_to_phys(pdev->mem_base) >> PAGE_SHIFT,
                 vma->vm_end - vma->vm_start, vma->vm_page_prot)) {
@@ -655,7 +851,7 @@ int symmbc_mmap(struct file *filp, struct vm_area_struct *vma)
             pr_err("<-- %s: BAR %lu is not configured.\n", __func__, vma->vm_pgoff);
             return -EFAULT;
         }
-        vma->vm_flags |= VM_IO | VM_DONTEXPAND;
+        symmbc_vm_flags_set(vma, VM_IO | VM_DONTEXPAND);
         if (remap_pfn_range(vma, vma->vm_start,
                 ((unsigned long)start) >> PAGE_SHIFT,
                 vma->vm_end - vma->vm_start, vma->vm_page_prot)) {
@@ -666,6 +862,254 @@ int symmbc_mmap(struct file *filp, struct vm_area_struct *vma)
     return 0;
 }
 
+//-------------------------------------------------------------------------
+// Physical address of the card seconds register
+//-------------------------------------------------------------------------
+static int symmbc_card_time_reg(struct symmbc_dev *pbc_dev, resource_size_t *phys)
+{
+#if SYMMBC_CARD_TIME
+    resource_size_t start = pci_resource_start(pbc_dev->ppci_dev, 4);
+
+    // The time page mapping must cover both registers
+    BUILD_BUG_ON((FPGA_CARD_MAJOR_TIME_OFFSET & PAGE_MASK) !=
+                 (FPGA_CARD_MINOR_TIME_OFFSET & PAGE_MASK));
+
+    if (0 == pci_resource_len(pbc_dev->ppci_dev, 4) || 0 == start)
+        return -ENODEV;
+    *phys = start + FPGA_CARD_MAJOR_TIME_OFFSET;
+    return 0;
+#else
+    return -ENODEV;
+#endif
+}
+
+//-------------------------------------------------------------------------
+// Read the card time, retrying if the seconds rolled over in between
+//-------------------------------------------------------------------------
+static int symmbc_read_card_time(struct symmbc_dev *pbc_dev, u32 *sec, u32 *nsec)
+{
+#if SYMMBC_CARD_TIME
+    u8 *pFPGA = (u8 *)pbc_dev->iomap_base[4];
+    u32 major, minor;
+
+    if (!pFPGA)
+        return -ENODEV;
+
+    do {
+        major = ioread32be(pFPGA + FPGA_CARD_MAJOR_TIME_OFFSET);
+        minor = ioread32be(pFPGA + FPGA_CARD_MINOR_TIME_OFFSET);
+        *sec  = ioread32be(pFPGA + FPGA_CARD_MAJOR_TIME_OFFSET);
+    } while (*sec != major);
+
+    *nsec = minor * FPGA_CARD_MINOR_TIME_UNIT_NS;
+    return 0;
+#else
+    return -ENODEV;
+#endif
+}
+
+//-------------------------------------------------------------------------
+// Take one host/card time sample
+//-------------------------------------------------------------------------
+static int symmbc_sample_time(struct symmbc_dev *pbc_dev, time_sample *ts)
+{
+    ktime_t mid, t0, t1;
+    u32 sec, nsec;
+    u64 lat;
+    int rc;
+
+    t0 = ktime_get();
+    rc = symmbc_read_card_time(pbc_dev, &sec, &nsec);
+    t1 = ktime_get();
+    if (rc)
+        return rc;
+
+    // Both host clocks at the middle of the card read
+    lat = ktime_to_ns(ktime_sub(t1, t0));
+    mid = ktime_add_ns(t0, lat >> 1);
+    ts->mono_ns   = ktime_to_ns(mid);
+    ts->real_ns   = ktime_to_ns(symmbc_mono_to_real(mid));
+    ts->card_sec  = sec;
+    ts->card_nsec = nsec;
+    ts->read_ns   = (u32)min_t(u64, lat, (u32)~0U);
+    ts->reserved  = 0;
+    return 0;
+}
+
+//-------------------------------------------------------------------------
+// Offset history timer - the single producer of the ring
+//-------------------------------------------------------------------------
+static enum hrtimer_restart symmbc_hist_timer(struct hrtimer *timer)
+{
+    struct symmbc_dev *pbc_dev = container_of(timer, struct symmbc_dev, hist_timer);
+    hist_ring *ring = pbc_dev->hist;
+    time_sample *samples = (time_sample *)((u8 *)ring + PAGE_SIZE);
+    u64 head = pbc_dev->hist_head;
+    u64 periods;
+
+    // Cannot fail, symmbc_hist_start() checked the card time is readable
+    symmbc_sample_time(pbc_dev, &samples[head & pbc_dev->hist_mask]);
+    pbc_dev->hist_head = ++head;
+    symmbc_store_release(&ring->head, head);
+
+    // Count the periods the timer fired too late to sample
+    periods = hrtimer_forward_now(timer, pbc_dev->hist_period);
+    if (periods > 1) {
+        pbc_dev->hist_missed += periods - 1;
+        symmbc_write_once(ring->missed, pbc_dev->hist_missed);
+    }
+    return HRTIMER_RESTART;
+}
+
+//-------------------------------------------------------------------------
+// Allocate the offset history ring and start sampling
+//-------------------------------------------------------------------------
+static void symmbc_hist_start(struct symmbc_dev *pbc_dev)
+{
+    time_sample probe;
+    u32 nsamples, hz;
+
+    if (symmbc_sample_time(pbc_dev, &probe)) {
+        pr_err("<-- %s: card time registers not available, offset history disabled.\n", __func__);
+        return;
+    }
+
+    hz = min(symmbc_hist_hz, SYMMBC_HIST_MAX_HZ);
+    nsamples = roundup_pow_of_two(clamp(symmbc_hist_len,
+                   SYMMBC_HIST_MIN_LEN, SYMMBC_HIST_MAX_LEN));
+
+    pbc_dev->hist = vmalloc_user(PAGE_SIZE + nsamples * sizeof(time_sample));
+    if (!pbc_dev->hist) {
+        pr_err("<-- %s: vmalloc_user() failed, offset history disabled.\n", __func__);
+        return;
+    }
+
+    pbc_dev->hist->version       = HIST_RING_VERSION;
+    pbc_dev->hist->nsamples      = nsamples;
+    pbc_dev->hist->rate_hz       = hz;
+    pbc_dev->hist->sample_offset = PAGE_SIZE;
+    pbc_dev->hist_mask = nsamples - 1;
+    pbc_dev->hist_head = 0;
+    pbc_dev->hist_missed = 0;
+    pbc_dev->hist_period = ktime_set(0, NSEC_PER_SEC / hz);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,13,0)
+    hrtimer_setup(&pbc_dev->hist_timer, symmbc_hist_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#else
+    hrtimer_init(&pbc_dev->hist_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    pbc_dev->hist_timer.function = symmbc_hist_timer;
+#endif
+    hrtimer_start(&pbc_dev->hist_timer, pbc_dev->hist_period, HRTIMER_MODE_REL);
+
+    pr_info("bcpci%d: offset history %u samples at %u Hz.\n",
+        pbc_dev->dev_minor, nsamples, hz);
+}
+
+//-------------------------------------------------------------------------
+// Stop sampling and free the offset history ring
+//-------------------------------------------------------------------------
+static void symmbc_hist_stop(struct symmbc_dev *pbc_dev)
+{
+    if (!pbc_dev->hist)
+        return;
+
+    hrtimer_cancel(&pbc_dev->hist_timer);
+    vfree(pbc_dev->hist);
+    pbc_dev->hist = NULL;
+}
+
+//-------------------------------------------------------------------------
+// SYMMBC_IOC_GET_TIME_SAMPLES
+//-------------------------------------------------------------------------
+static long symmbc_get_time_samples(struct symmbc_dev *pbc_dev, unsigned long arg)
+{
+    time_samples_req req;
+    time_sample ts[8];
+    time_sample __user *dst;
+    u32 i, n, done;
+    int rc;
+
+    if (copy_from_user(&req, (void __user *)arg, sizeof(req)))
+        return -EFAULT;
+    if (req.flags || 0 == req.count)
+        return -EINVAL;
+
+    dst = (time_sample __user *)(unsigned long)req.addr;
+    req.count = min_t(u32, req.count, SYMMBC_TIME_SAMPLES_MAX);
+
+    // Sample in small bursts so the reads stay close together
+    for (done = 0; done < req.count; done += n) {
+        n = min_t(u32, req.count - done, ARRAY_SIZE(ts));
+        for (i = 0; i < n; i++) {
+            rc = symmbc_sample_time(pbc_dev, &ts[i]);
+            if (rc)
+                return rc;
+        }
+        if (copy_to_user(dst + done, ts, n * sizeof(time_sample)))
+            return -EFAULT;
+    }
+    return done;
+}
+
+//-------------------------------------------------------------------------
+// SYMMBC_IOC_GET_TIME_MMAP_CONFIG
+//-------------------------------------------------------------------------
+static long symmbc_get_time_mmap_config(struct symmbc_dev *pbc_dev, unsigned long arg)
+{
+    time_mmap_config cfg;
+    resource_size_t reg;
+
+    if (symmbc_card_time_reg(pbc_dev, &reg))
+        return -ENODEV;
+
+    cfg.length = PAGE_SIZE;
+    cfg.offset = ((unsigned long)reg) & ~PAGE_MASK;
+    if (copy_to_user((void __user *)arg, &cfg, sizeof(cfg)))
+        return -EFAULT;
+    return 0;
+}
+
+#if SYMMBC_URING
+
+//-------------------------------------------------------------------------
+// The ioctl argument from the SQE command area - 6.5 passes the whole SQE
+//-------------------------------------------------------------------------
+static inline u64 symmbc_uring_arg(struct io_uring_cmd *ioucmd)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,5,0)
+    return READ_ONCE(*(const u64 *)io_uring_sqe_cmd(ioucmd->sqe));
+#else
+    return READ_ONCE(*(const u64 *)ioucmd->cmd);
+#endif
+}
+
+//-------------------------------------------------------------------------
+// io_uring passthrough - every command completes synchronously, the
+// return value becomes the CQE result
+//-------------------------------------------------------------------------
+static int symmbc_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+    switch(ioucmd->cmd_op) {
+
+        case SYMMBC_IOC_GET_TIME_SAMPLES:
+        case SYMMBC_IOC_GET_TIME_MMAP_CONFIG:
+            // Lock-free queries, fine to run inline
+            break;
+
+        default:
+            // Configuration commands take the device mutex, let io_uring
+            // retry them from a context that may sleep
+            if (issue_flags & IO_URING_F_NONBLOCK)
+                return -EAGAIN;
+            break;
+    }
+
+    return symmbc_unlocked_ioctl(ioucmd->file, ioucmd->cmd_op,
+               (unsigned long)symmbc_uring_arg(ioucmd));
+}
+
+#endif
+
 //-------------------------------------------------------------------------
 // symmbc_irq - dummy for the moment
 //-------------------------------------------------------------------------
@@ -686,6 +1130,10 @@ static int __init symmbc_init(void)
     dev_t dev_num = MKDEV(symmbc_major, 0);
     int rc;
 
+    // The extended mmap offsets must not shadow the DMA buffer
+    BUILD_BUG_ON(HIST_MMAP_PGOFF == DMA_MMAP_PGOFF);
+    BUILD_BUG_ON(TIME_MMAP_PGOFF == DMA_MMAP_PGOFF);
+
     // Register the major device
     if (symmbc_major) {
         rc = register_chrdev_region(dev_num, symmbc_ndevs, DEV_NAME);
@@ -705,7 +1153,7 @@ static int __init symmbc_init(void)
     // Device minor number starts from 0
     atomic_set(&curr_minor, 0);
 
-    symmbc_class = class_create(THIS_MODULE, CLASS_NAME);
+    symmbc_class = symmbc_class_create(CLASS_NAME);
     if (IS_ERR(symmbc_class)) {
         unregister_chrdev_region(dev_num, symmbc_ndevs);
         pr_err("<-- %s: class_create() failed.\n", __func__);
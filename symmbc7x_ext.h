@@ -0,0 +1,116 @@
+//***************************************************************************
+//
+// symmbc7x_ext.h
+//
+// Symmetricom bc7xxPCIe driver - extended interface
+//
+// Definitions shared by the driver and applications for the interfaces
+// added on top of symmbc7x.h.
+//
+//***************************************************************************
+
+#ifndef SYMMBC7X_EXT_H
+#define SYMMBC7X_EXT_H
+
+#include <linux/types.h>
+
+//-------------------------------------------------------------------------
+// Host/card time sample
+//-------------------------------------------------------------------------
+typedef struct {
+    __u64 mono_ns;      // host CLOCK_MONOTONIC at the middle of the card read
+    __u64 real_ns;      // host CLOCK_REALTIME at the middle of the card read
+    __u32 card_sec;     // card time, seconds
+    __u32 card_nsec;    // card time, nanoseconds
+    __u32 read_ns;      // duration of the card read
+    __u32 reserved;
+} time_sample;
+
+//-------------------------------------------------------------------------
+// Offset history ring
+//
+// When the driver is loaded with symmbc_hist_hz > 0 every card samples
+// its time into a ring of time_sample at that rate. mmap() with page
+// offset HIST_MMAP_PGOFF maps the ring read-only, so O_RDONLY descriptors
+// can use it: the first page holds hist_ring, the samples start at
+// sample_offset.
+//
+// The driver is the only writer. Each reader keeps its own position pos:
+// it reads head with acquire semantics, copies the samples from
+// max(pos, head > nsamples ? head - nsamples : 0) up to head, then, after
+// smp_rmb() (or with acquire ordering, so it cannot move before the
+// copies), re-reads head and drops every copied index i with
+// i + nsamples <= head: those were overwritten while copying and may be
+// torn. Samples between pos and the first index kept were lost to that
+// reader.
+// missed counts the sampling periods the driver's timer could not serve.
+//-------------------------------------------------------------------------
+#define HIST_MMAP_PGOFF     0x100
+#define HIST_RING_VERSION   1
+
+typedef struct {
+    __u32 version;      // HIST_RING_VERSION
+    __u32 nsamples;     // ring size in samples, power of two
+    __u32 rate_hz;      // sampling rate
+    __u32 sample_offset;// byte offset of sample 0 from the start of the map
+    __u64 head;         // samples written since load
+    __u64 missed;       // sampling periods skipped
+} hist_ring;
+
+//-------------------------------------------------------------------------
+// Card time register page
+//
+// mmap() of one page with page offset TIME_MMAP_PGOFF maps, read-only and
+// uncached, only the BAR4 page holding the card time registers. This also
+// works on a descriptor opened O_RDONLY, which cannot map the BARs.
+// SYMMBC_IOC_GET_TIME_MMAP_CONFIG reports where the seconds register sits
+// in the page; FPGA_CARD_*_TIME_* in symmbc7x.h describe the registers.
+// Read seconds, sub-seconds, seconds and retry if the seconds changed.
+//-------------------------------------------------------------------------
+#define TIME_MMAP_PGOFF     0x101
+
+typedef struct {
+    __u32 length;       // bytes to map
+    __u32 offset;       // offset of the seconds register within the page
+} time_mmap_config;
+
+//-------------------------------------------------------------------------
+// Extended ioctls
+//
+// Numbered from SYMMBC_IOC_EXT_BASE so they stay clear of the commands in
+// symmbc7x.h, which must be included first for SYMMBC_IOC_MAGIC.
+//
+// SYMMBC_IOC_GET_TIME_SAMPLES takes back-to-back host/card time samples
+// into the time_sample array at addr and returns the number taken, at
+// most SYMMBC_TIME_SAMPLES_MAX.
+//-------------------------------------------------------------------------
+#define SYMMBC_TIME_SAMPLES_MAX     64
+
+typedef struct {
+    __u64 addr;         // user pointer to time_sample[count]
+    __u32 count;
+    __u32 flags;        // must be 0
+} time_samples_req;
+
+#define SYMMBC_IOC_EXT_BASE         0x40
+#define SYMMBC_IOC_GET_TIME_SAMPLES _IOW(SYMMBC_IOC_MAGIC, 0x40, time_samples_req)
+#define SYMMBC_IOC_GET_TIME_MMAP_CONFIG _IOR(SYMMBC_IOC_MAGIC, 0x41, time_mmap_config)
+#define SYMMBC_IOC_EXT_MAX          0x41
+
+//-------------------------------------------------------------------------
+// io_uring passthrough
+//
+// On drivers built with SYMMBC_URING=1 (kernels 5.19 and later) every
+// ioctl is also available as IORING_OP_URING_CMD with cmd_op set to
+// the ioctl number and the first 8 bytes of sqe->cmd holding the ioctl
+// argument as a __u64. The CQE res carries the ioctl return value.
+// The queries run inline; commands that take the device mutex are
+// retried by io_uring from its worker threads.
+//
+// There is no command that waits for host time update or 1PPS events:
+// the driver cannot tell them apart on the interrupt line until the
+// card's interrupt status register is documented. Poll the host time
+// page or use the offset history instead.
+//-------------------------------------------------------------------------
+
+#endif // SYMMBC7X_EXT_H
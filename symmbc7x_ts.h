@@ -0,0 +1,354 @@
+//***************************************************************************
+//
+// symmbc7x_ts.h
+//
+// Symmetricom bc7xxPCIe - batched TSC timestamping for applications
+//
+// Header-only helper that converts TSC readings taken when records arrive
+// into card time, a whole batch per call. Batches are converted from a
+// (card time, TSC) anchor taken on an observed change of the host time
+// page the card writes into the DMA buffer (mmap at DMA_MMAP_PGOFF, plus
+// mmap_config.dma.offset), so the pair is coherent to one page read. The
+// anchor and the TSC rate are refreshed about every SYMMBC_TS_RESYNC_NS
+// and after a card time step, which costs one spin of up to a page update
+// period.
+//
+// The page layout comes from symmbc7x.h, which must be included first and
+// define DMA_TIME_MAJOR_OFFSET and DMA_TIME_MINOR_OFFSET (byte offsets of
+// the seconds and sub-second words), DMA_TIME_MINOR_UNIT_NS and
+// DMA_TIME_BIG_ENDIAN, as given by the card documentation.
+//
+// Strict ISO C builds (-std=c11) must define _POSIX_C_SOURCE >= 199309L
+// for clock_gettime(CLOCK_MONOTONIC).
+//
+// A symmbc_ts_ctx is per thread; it is not locked. Typical use:
+//
+//     symmbc_ts_ctx ctx;
+//     symmbc_ts_init(&ctx, dma + mm_cfg.dma.offset, 10000000);
+//     ...
+//     rec_tsc[i] = symmbc_ts_rdtsc();         // on arrival
+//     ...
+//     if (symmbc_ts_stamp(&ctx, rec_tsc, rec_ns, n) < 0)
+//         ...                                 // card stopped updating
+//
+// Timestamps are nanoseconds since the epoch, never go backwards within a
+// context, and are only as accurate as the card's host page update period.
+//
+//***************************************************************************
+
+#ifndef SYMMBC7X_TS_H
+#define SYMMBC7X_TS_H
+
+#if !defined(__x86_64__)
+#error "symmbc7x_ts.h needs an x86-64 TSC"
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <immintrin.h>
+#include <x86intrin.h>
+
+// CLOCK_MONOTONIC is POSIX, not ISO C
+#if !defined(CLOCK_MONOTONIC)
+#error "symmbc7x_ts.h needs POSIX clocks: define _POSIX_C_SOURCE >= 199309L before including <time.h>"
+#endif
+
+#if !defined(DMA_TIME_MAJOR_OFFSET) || !defined(DMA_TIME_MINOR_OFFSET) || \
+    !defined(DMA_TIME_MINOR_UNIT_NS) || !defined(DMA_TIME_BIG_ENDIAN)
+#error "symmbc7x_ts.h: include symmbc7x.h first; it must define the DMA_TIME_* host page layout"
+#endif
+
+//-------------------------------------------------------------------------
+// Calibration and resync intervals, in card nanoseconds. A resync only
+// re-derives the rate when the card interval is within 1/SYMMBC_TS_RATE_TOL
+// of the CLOCK_MONOTONIC one, which covers NTP slew (500 ppm).
+//-------------------------------------------------------------------------
+#define SYMMBC_TS_CALIB_NS      10000000ULL
+#define SYMMBC_TS_RESYNC_NS     1000000000ULL
+#define SYMMBC_TS_INIT_WAIT_NS  2000000000LL
+#define SYMMBC_TS_RATE_TOL      1000
+
+//-------------------------------------------------------------------------
+// Per-thread context
+//-------------------------------------------------------------------------
+typedef struct {
+    const volatile uint8_t *page;   // host time page
+    uint64_t stale_ns;              // max age of the page value
+    uint64_t stale_cycles;          // stale_ns in TSC cycles
+    uint64_t anchor_tsc;            // TSC right after the page changed
+    uint64_t anchor_ns;             // card time the page changed to
+    uint64_t anchor_mono;           // CLOCK_MONOTONIC right after anchor_tsc
+    uint32_t mult;                  // ns = cycles * mult >> shift
+    uint32_t shift;
+    uint64_t last_ns;               // last timestamp handed out
+    int      use_avx2;
+} symmbc_ts_ctx;
+
+//-------------------------------------------------------------------------
+// TSC read for record arrival
+//-------------------------------------------------------------------------
+static inline uint64_t symmbc_ts_rdtsc(void)
+{
+    return __rdtsc();
+}
+
+//-------------------------------------------------------------------------
+// CLOCK_MONOTONIC in nanoseconds
+//-------------------------------------------------------------------------
+static inline uint64_t symmbc_ts_mono_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+//-------------------------------------------------------------------------
+// Coherent read of the host time page, in nanoseconds
+//-------------------------------------------------------------------------
+static inline uint64_t symmbc_ts_read_page(const volatile uint8_t *page)
+{
+    const volatile uint32_t *major = (const volatile uint32_t *)(page + DMA_TIME_MAJOR_OFFSET);
+    const volatile uint32_t *minor = (const volatile uint32_t *)(page + DMA_TIME_MINOR_OFFSET);
+    uint32_t sec, sub;
+
+    do {
+        sec = *major;
+        sub = *minor;
+    } while (*major != sec);
+
+    if (DMA_TIME_BIG_ENDIAN) {
+        sec = ntohl(sec);
+        sub = ntohl(sub);
+    }
+    return (uint64_t)sec * 1000000000ULL + (uint64_t)sub * DMA_TIME_MINOR_UNIT_NS;
+}
+
+//-------------------------------------------------------------------------
+// Convert a cycle count to nanoseconds, any magnitude
+//-------------------------------------------------------------------------
+static inline uint64_t symmbc_ts_cyc2ns(const symmbc_ts_ctx *ctx, uint64_t cycles)
+{
+    return (uint64_t)(((unsigned __int128)cycles * ctx->mult) >> ctx->shift);
+}
+
+//-------------------------------------------------------------------------
+// Set mult/shift from a (cycles, ns) interval. mult stays within 32 bits
+// so the AVX2 path can use 32x32->64 multiplies. Returns -ERANGE, leaving
+// the context alone, if the rate does not fit.
+//-------------------------------------------------------------------------
+static inline int symmbc_ts_set_rate(symmbc_ts_ctx *ctx, uint64_t cycles, uint64_t ns)
+{
+    unsigned __int128 m;
+    uint32_t shift;
+
+    if (0 == cycles)
+        return -ERANGE;
+    for (shift = 32; ; shift--) {
+        m = ((unsigned __int128)ns << shift) / cycles;
+        if (m <= UINT32_MAX || 0 == shift)
+            break;
+    }
+    if (m > UINT32_MAX || 0 == m)
+        return -ERANGE;
+
+    ctx->mult  = (uint32_t)m;
+    ctx->shift = shift;
+    ctx->stale_cycles = (uint64_t)(((unsigned __int128)ctx->stale_ns << shift) / m);
+    return 0;
+}
+
+//-------------------------------------------------------------------------
+// Spin until the page value changes and return that edge: the new value
+// and the TSC read right after the first read showing it. Gives up after
+// limit_cycles, or after SYMMBC_TS_INIT_WAIT_NS of CLOCK_MONOTONIC when
+// limit_cycles is 0 (before the TSC is calibrated).
+//-------------------------------------------------------------------------
+static inline int symmbc_ts_wait_change(const volatile uint8_t *page, uint64_t from,
+                                        uint64_t limit_cycles, uint64_t *ns, uint64_t *tsc)
+{
+    struct timespec now, end;
+    uint64_t start = symmbc_ts_rdtsc();
+    uint32_t spins = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    end.tv_sec += SYMMBC_TS_INIT_WAIT_NS / 1000000000LL;
+
+    for (;;) {
+        *ns = symmbc_ts_read_page(page);
+        _mm_lfence();
+        *tsc = symmbc_ts_rdtsc();
+        if (*ns != from)
+            return 0;
+        if (limit_cycles) {
+            if (*tsc - start > limit_cycles)
+                return -ESTALE;
+        }
+        else if (0 == (++spins & 0xfff)) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (now.tv_sec > end.tv_sec ||
+                (now.tv_sec == end.tv_sec && now.tv_nsec >= end.tv_nsec))
+                return -ESTALE;
+        }
+        _mm_pause();
+    }
+}
+
+//-------------------------------------------------------------------------
+// Initialise a context: calibrates the TSC against the card, which takes
+// about SYMMBC_TS_CALIB_NS. Returns 0, -ESTALE if the page does not
+// advance, or -ERANGE if the measured rate is unusable. stale_ns is how far the page may lag the TSC-extrapolated
+// card time before symmbc_ts_stamp() refuses to stamp.
+//-------------------------------------------------------------------------
+static inline int symmbc_ts_init(symmbc_ts_ctx *ctx, const volatile void *page,
+                                 uint64_t stale_ns)
+{
+    uint64_t ns0, tsc0, ns1, tsc1;
+
+    ctx->page     = (const volatile uint8_t *)page;
+    ctx->stale_ns = stale_ns;
+    ctx->last_ns  = 0;
+    ctx->use_avx2 = __builtin_cpu_supports("avx2");
+
+    // Anchor both ends of the interval on a page change
+    if (symmbc_ts_wait_change(ctx->page, symmbc_ts_read_page(ctx->page), 0, &ns0, &tsc0))
+        return -ESTALE;
+    ns1 = ns0;
+    do {
+        if (symmbc_ts_wait_change(ctx->page, ns1, 0, &ns1, &tsc1))
+            return -ESTALE;
+        // Card time stepped back: restart the interval from this edge
+        if (ns1 < ns0) {
+            ns0  = ns1;
+            tsc0 = tsc1;
+        }
+    } while (ns1 - ns0 < SYMMBC_TS_CALIB_NS || tsc1 == tsc0);
+
+    if (symmbc_ts_set_rate(ctx, tsc1 - tsc0, ns1 - ns0))
+        return -ERANGE;
+    ctx->anchor_tsc  = tsc1;
+    ctx->anchor_ns   = ns1;
+    ctx->anchor_mono = symmbc_ts_mono_ns();
+    return 0;
+}
+
+//-------------------------------------------------------------------------
+// Keep the anchor while the page agrees with the card time extrapolated
+// from it, to within stale_ns, and it is younger than SYMMBC_TS_RESYNC_NS.
+// Otherwise (resync due, card time step, drift over a long idle gap) move
+// it to the next page edge. The rate is re-derived from the two edges
+// only when no step falls between them, i.e. their card interval matches
+// the CLOCK_MONOTONIC one to within 1/SYMMBC_TS_RATE_TOL; checking against
+// the TSC prediction instead would never correct a poor calibration.
+// Returns -ESTALE if the page does not change within stale_ns.
+//-------------------------------------------------------------------------
+static inline int symmbc_ts_anchor(symmbc_ts_ctx *ctx)
+{
+    uint64_t ns  = symmbc_ts_read_page(ctx->page);
+    uint64_t age = symmbc_ts_cyc2ns(ctx, symmbc_ts_rdtsc() - ctx->anchor_tsc);
+    uint64_t est = ctx->anchor_ns + age;
+    uint64_t edge_ns, edge_tsc, mono, mono_span, span, dev;
+
+    // The page trails card time by at most one update
+    if (age < SYMMBC_TS_RESYNC_NS &&
+        (est > ns ? est - ns : ns - est) <= ctx->stale_ns)
+        return 0;
+
+    if (symmbc_ts_wait_change(ctx->page, ns, ctx->stale_cycles, &edge_ns, &edge_tsc))
+        return -ESTALE;
+
+    mono = symmbc_ts_mono_ns();
+
+    mono_span = mono - ctx->anchor_mono;
+    if (edge_ns > ctx->anchor_ns && mono_span >= SYMMBC_TS_CALIB_NS) {
+        span = edge_ns - ctx->anchor_ns;
+        dev  = span > mono_span ? span - mono_span : mono_span - span;
+        if (dev <= mono_span / SYMMBC_TS_RATE_TOL)
+            symmbc_ts_set_rate(ctx, edge_tsc - ctx->anchor_tsc, span);
+    }
+    ctx->anchor_tsc  = edge_tsc;
+    ctx->anchor_ns   = edge_ns;
+    ctx->anchor_mono = mono;
+    return 0;
+}
+
+//-------------------------------------------------------------------------
+// Scalar conversion of records [from, n)
+//-------------------------------------------------------------------------
+static inline void symmbc_ts_conv_scalar(const symmbc_ts_ctx *ctx, const uint64_t *tsc,
+                                         uint64_t *ns, size_t from, size_t n)
+{
+    size_t i;
+
+    for (i = from; i < n; i++) {
+        if (tsc[i] >= ctx->anchor_tsc)
+            ns[i] = ctx->anchor_ns + symmbc_ts_cyc2ns(ctx, tsc[i] - ctx->anchor_tsc);
+        else
+            ns[i] = ctx->anchor_ns - symmbc_ts_cyc2ns(ctx, ctx->anchor_tsc - tsc[i]);
+    }
+}
+
+//-------------------------------------------------------------------------
+// AVX2 conversion, four records per step. Steps with a record more than
+// 2^32 cycles away from the anchor fall back to the scalar path.
+//-------------------------------------------------------------------------
+__attribute__((target("avx2")))
+static inline size_t symmbc_ts_conv_avx2(const symmbc_ts_ctx *ctx, const uint64_t *tsc,
+                                         uint64_t *ns, size_t n)
+{
+    const __m256i anchor_tsc = _mm256_set1_epi64x((long long)ctx->anchor_tsc);
+    const __m256i anchor_ns  = _mm256_set1_epi64x((long long)ctx->anchor_ns);
+    const __m256i mult       = _mm256_set1_epi64x(ctx->mult);
+    const __m128i shift      = _mm_cvtsi32_si128((int)ctx->shift);
+    const __m256i zero       = _mm256_setzero_si256();
+    size_t i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m256i d   = _mm256_sub_epi64(_mm256_loadu_si256((const __m256i *)(tsc + i)), anchor_tsc);
+        __m256i neg = _mm256_cmpgt_epi64(zero, d);
+        __m256i ad  = _mm256_sub_epi64(_mm256_xor_si256(d, neg), neg);
+        __m256i q;
+
+        if (!_mm256_testz_si256(_mm256_srli_epi64(ad, 32), _mm256_srli_epi64(ad, 32))) {
+            symmbc_ts_conv_scalar(ctx, tsc, ns, i, i + 4);
+            continue;
+        }
+        q = _mm256_srl_epi64(_mm256_mul_epu32(ad, mult), shift);
+        q = _mm256_sub_epi64(_mm256_xor_si256(q, neg), neg);
+        _mm256_storeu_si256((__m256i *)(ns + i), _mm256_add_epi64(anchor_ns, q));
+    }
+    return i;
+}
+
+//-------------------------------------------------------------------------
+// Stamp n records: tsc[] holds their arrival TSC, ns[] receives card time.
+// Returns 0, or -ESTALE (ns[] untouched) if the card stopped updating the
+// host page.
+//-------------------------------------------------------------------------
+static inline int symmbc_ts_stamp(symmbc_ts_ctx *ctx, const uint64_t *tsc,
+                                  uint64_t *ns, size_t n)
+{
+    uint64_t last;
+    size_t i = 0;
+
+    if (symmbc_ts_anchor(ctx))
+        return -ESTALE;
+
+    if (ctx->use_avx2)
+        i = symmbc_ts_conv_avx2(ctx, tsc, ns, n);
+    symmbc_ts_conv_scalar(ctx, tsc, ns, i, n);
+
+    // Keep time monotonic across records and anchors
+    last = ctx->last_ns;
+    for (i = 0; i < n; i++) {
+        last  = ns[i] > last ? ns[i] : last;
+        ns[i] = last;
+    }
+    ctx->last_ns = last;
+    return 0;
+}
+
+#endif // SYMMBC7X_TS_H